@@ -24,9 +24,11 @@
 
 #include "HttpUpdate.h"
 #include <StreamString.h>
+#include <Preferences.h>
 
 #include <esp_partition.h>
 #include <esp_ota_ops.h>                // get running partition
+#include <esp_idf_version.h>
 
 // To do extern "C" uint32_t _SPIFFS_start;
 // To do extern "C" uint32_t _SPIFFS_end;
@@ -116,7 +118,7 @@ HttpUpdateResult HttpUpdate::update(Client& client, const String& url, const Str
         _setLastError(HTTP_ERROR_API);
         return HTTP_UPDATE_FAILED;
     }
-    return handleUpdate(http, currentVersion, false);
+    return handleUpdate(http, currentVersion, false, url);
 }
 
 HttpUpdateResult HttpUpdate::updateSpiffs(HttpClientEx& httpClient, const String& currentVersion)
@@ -132,7 +134,7 @@ HttpUpdateResult HttpUpdate::updateSpiffs(Client& client, const String& url, con
         _setLastError(HTTP_ERROR_API);
         return HTTP_UPDATE_FAILED;
     }
-    return handleUpdate(http, currentVersion, true);
+    return handleUpdate(http, currentVersion, true, url);
 }
 
 HttpUpdateResult HttpUpdate::update(HttpClientEx& httpClient, const String& currentVersion)
@@ -145,7 +147,17 @@ HttpUpdateResult HttpUpdate::update(Client& client, const String& host, uint16_t
 {
     HttpClientEx http(client);
     http.begin(host, port, uri);
-    return handleUpdate(http, currentVersion, false);
+    return handleUpdate(http, currentVersion, false, String("http://") + host + ":" + port + uri);
+}
+
+HttpUpdateResult HttpUpdate::update(Client& client, const String urls[], size_t count, const String& currentVersion)
+{
+    return handleMirrorUpdate(client, urls, count, currentVersion, false);
+}
+
+HttpUpdateResult HttpUpdate::updateSpiffs(Client& client, const String urls[], size_t count, const String& currentVersion)
+{
+    return handleMirrorUpdate(client, urls, count, currentVersion, true);
 }
 
 /**
@@ -200,6 +212,18 @@ String HttpUpdate::getLastErrorString(void)
         return "New Binary Does Not Fit Flash Size";
     case HTTP_UE_NO_PARTITION:
         return "Partition Could Not be Found";
+    case HTTP_UE_NO_MIRROR:
+        return "No Mirror Given";
+    case HTTP_UE_ALL_MIRRORS_FAILED:
+        return "All Mirrors Failed";
+    case HTTP_UE_BIN_FOR_WRONG_CHIP:
+        return "New Binary Is For Another Chip";
+    case HTTP_UE_BIN_WRONG_PROJECT:
+        return "New Binary Is For Another Project";
+    case HTTP_UE_TOO_MANY_REDIRECTS:
+        return "Too Many Redirects";
+    case HTTP_UE_DOWNLOAD_STALLED:
+        return "Download Stalled";
     }
 
     return String();
@@ -233,16 +257,15 @@ String getSketchSHA256() {
 }
 
 /**
- *
- * @param http HTTPClient *
- * @param currentVersion const char *
- * @return HttpUpdateResult
+ * send the update request with the ESP32 info headers
+ * @param http HttpClientEx&
+ * @param currentVersion const String&
+ * @param spiffs bool
+ * @param rangeStart uint32_t first byte wanted, 0 for the whole image
+ * @return 0 or HTTP client error
  */
-HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& currentVersion, bool spiffs)
+int HttpUpdate::sendUpdateRequest(HttpClientEx& http, const String& currentVersion, bool spiffs, uint32_t rangeStart)
 {
-
-    HttpUpdateResult ret = HTTP_UPDATE_FAILED;
-
     // use HTTP/1.0 for update since the update handler not support any transfer Encoding
     //http.useHTTP10(true);
     http.setHttpResponseTimeout(_httpClientTimeout);
@@ -253,8 +276,7 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
 
     if(code != 0) {
         log_e("HTTP error: %d\n", code);
-        _setLastError(code);
-        return HTTP_UPDATE_FAILED;
+        return code;
     }
 
     http.sendAuthorizationHeader();
@@ -282,12 +304,353 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
     if(currentVersion && currentVersion[0] != 0x00) {
         http.sendHeader("x-ESP32-version", currentVersion.c_str());
     }
+    if(rangeStart > 0) {
+        http.sendHeader("Range", String("bytes=") + rangeStart + "-");
+    }
     http.endRequest();
 
-    code = http.responseStatusCode();
+    return 0;
+}
+
+/**
+ * resolve a Location header against the url it was received for
+ * @param base const String& absolute url, may be empty
+ * @param location const String&
+ * @return String absolute url, empty if it cannot be resolved
+ */
+static String resolveLocation(const String& base, const String& location)
+{
+    if(location.startsWith("http://") || location.startsWith("https://")) {
+        return location;
+    }
+
+    int scheme = base.indexOf("://");
+    if(scheme < 0 || !location.length()) {
+        return String();
+    }
+    if(location.startsWith("//")) {
+        return base.substring(0, scheme + 1) + location;
+    }
+
+    int path = base.indexOf('/', scheme + 3);
+    if(path < 0) {
+        path = base.length();
+    }
+    if(location[0] == '/') {
+        return base.substring(0, path) + location;
+    }
+
+    // relative to the directory of the base path, without its query
+    int query = base.indexOf('?', path);
+    int dir = base.lastIndexOf('/', query < 0 ? base.length() - 1 : query);
+    if(dir < path) {
+        return base.substring(0, path) + "/" + location;
+    }
+    return base.substring(0, dir + 1) + location;
+}
+
+/**
+ * send the update request and read the response status, following redirects
+ * @param http HttpClientEx& begun with url
+ * @param url const String& requested url, empty if unknown
+ * @param currentVersion const String&
+ * @param spiffs bool
+ * @param rangeStart uint32_t first byte wanted, 0 for the whole image
+ * @param headers HttpClientEx::Headers* headers to collect, the last one must be "Location"
+ * @param count size_t
+ * @return HTTP status code, or HTTP client / HTTP_UE_* error
+ */
+int HttpUpdate::requestUpdate(HttpClientEx& http, const String& url, const String& currentVersion, bool spiffs,
+        uint32_t rangeStart, HttpClientEx::Headers* headers, size_t count)
+{
+    String location = url;
+    RedirectEntry* cached = _followRedirects ? findRedirect(url) : NULL;
+    if(cached) {
+        log_d("Using cached redirect %s -> %s\n", url.c_str(), cached->target.c_str());
+        location = cached->target;
+        http.stop();
+        if(!http.begin(location)) {
+            return HTTP_ERROR_API;
+        }
+    }
+
+    // a chain that starts at a temporary cached redirect stays temporary
+    bool permanent = cached ? cached->permanent : true;
+    uint16_t redirects = 0;
+    for(;;) {
+        int code = sendUpdateRequest(http, currentVersion, spiffs, rangeStart);
+        if(code == 0) {
+            code = http.responseStatusCode();
+        }
+        if(code >= 0) {
+            http.collectHeaders(headers, count);
+        }
+
+        bool redirect = code == HTTP_CODE_MOVED_PERMANENTLY || code == HTTP_CODE_FOUND || code == HTTP_CODE_SEE_OTHER ||
+                        code == HTTP_CODE_TEMPORARY_REDIRECT || code == HTTP_CODE_PERMANENT_REDIRECT;
+
+        if(cached && !redirect && code != HTTP_CODE_OK && code != HTTP_CODE_PARTIAL_CONTENT && code != HTTP_CODE_NOT_MODIFIED) {
+            // the cached target failed, start over from the requested url
+            log_w("Cached redirect %s failed (%d)\n", location.c_str(), code);
+            cached->url = String();
+            cached = NULL;
+            location = url;
+            permanent = true;
+            redirects = 0;
+            http.stop();
+            if(!http.begin(location)) {
+                return HTTP_ERROR_API;
+            }
+            continue;
+        }
+
+        if(!redirect || !_followRedirects) {
+            // only a target that served the request is worth going back to
+            if(redirects > 0 && (code == HTTP_CODE_OK || code == HTTP_CODE_PARTIAL_CONTENT || code == HTTP_CODE_NOT_MODIFIED)) {
+                rememberRedirect(url, location, permanent);
+            }
+            return code;
+        }
+
+        if(++redirects > _redirectLimit) {
+            log_e("Too many redirects (%d)\n", redirects);
+            return HTTP_UE_TOO_MANY_REDIRECTS;
+        }
+
+        String next = resolveLocation(location, headers[count - 1].value);
+        if(!next.length()) {
+            log_e("Cannot follow redirect to \"%s\"\n", headers[count - 1].value.c_str());
+            return HTTP_UE_SERVER_WRONG_HTTP_CODE;
+        }
+        log_d("Redirect (%d) %s -> %s\n", code, location.c_str(), next.c_str());
+        location = next;
+        permanent = permanent && (code == HTTP_CODE_MOVED_PERMANENTLY || code == HTTP_CODE_PERMANENT_REDIRECT);
+
+        http.stop();
+        if(!http.begin(location)) {
+            return HTTP_ERROR_API;
+        }
+    }
+}
+
+HttpUpdate::RedirectEntry* HttpUpdate::findRedirect(const String& url)
+{
+    if(!url.length()) {
+        return NULL;
+    }
+    for(size_t i = 0; i < HTTP_UPDATE_REDIRECTS; i++) {
+        RedirectEntry& entry = _redirects[i];
+        if(entry.url == url) {
+            if(!entry.permanent && millis() - entry.seen > HTTP_UPDATE_REDIRECT_TTL) {
+                entry.url = String();
+                return NULL;
+            }
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * remember where url finally led, permanent targets are kept until they fail
+ * @param url const String&
+ * @param target const String&
+ * @param permanent bool all redirects were 301 or 308
+ */
+void HttpUpdate::rememberRedirect(const String& url, const String& target, bool permanent)
+{
+    if(!url.length()) {
+        return;
+    }
+
+    // take the url's slot, a free one, or the oldest
+    RedirectEntry* entry = findRedirect(url);
+    for(size_t i = 0; !entry && i < HTTP_UPDATE_REDIRECTS; i++) {
+        if(!_redirects[i].url.length()) {
+            entry = &_redirects[i];
+        }
+    }
+    if(!entry) {
+        entry = &_redirects[0];
+        for(size_t i = 1; i < HTTP_UPDATE_REDIRECTS; i++) {
+            if(millis() - _redirects[i].seen > millis() - entry->seen) {
+                entry = &_redirects[i];
+            }
+        }
+    }
+
+    entry->url = url;
+    entry->target = target;
+    entry->permanent = permanent;
+    entry->seen = millis();
+}
+
+void HttpUpdate::forgetRedirect(const String& url)
+{
+    RedirectEntry* entry = findRedirect(url);
+    if(entry) {
+        entry->url = String();
+    }
+}
+
+void HttpUpdate::clearRedirectCache(void)
+{
+    for(size_t i = 0; i < HTTP_UPDATE_REDIRECTS; i++) {
+        _redirects[i].url = String();
+    }
+}
+
+/**
+ * check that an image of len bytes fits the target partition
+ * @param len int
+ * @param spiffs bool
+ * @return true if the image fits
+ */
+bool HttpUpdate::checkUpdateSpace(int len, bool spiffs)
+{
+    if(spiffs) {
+        const esp_partition_t* _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+        if(!_partition){
+            _setLastError(HTTP_UE_NO_PARTITION);
+            return false;
+        }
+
+        if(len > _partition->size) {
+            log_e("spiffsSize to low (%d) needed: %d\n", _partition->size, len);
+            _setLastError(HTTP_UE_TOO_LESS_SPACE);
+            return false;
+        }
+    } else {
+        int sketchFreeSpace = ESP.getFreeSketchSpace();
+        if(!sketchFreeSpace){
+            _setLastError(HTTP_UE_NO_PARTITION);
+            return false;
+        }
+
+        if(len > sketchFreeSpace) {
+            log_e("FreeSketchSpace to low (%d) needed: %d\n", sketchFreeSpace, len);
+            _setLastError(HTTP_UE_TOO_LESS_SPACE);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * read the image header block, up to the app descriptor, and check it against
+ * the running firmware before anything is written to flash
+ * @param http HttpClientEx& positioned at the start of the body
+ * @param len int image size
+ * @param header uint8_t[HTTP_UPDATE_IMAGE_HEADER_SIZE] receives the header block
+ * @return 0 if the header is valid, HTTP_UE_BIN_* error otherwise
+ */
+int HttpUpdate::checkImageHeader(HttpClientEx& http, int len, uint8_t* header)
+{
+    if(len < (int)HTTP_UPDATE_IMAGE_HEADER_SIZE) {
+        log_e("Image too short for a header (%d)\n", len);
+        return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+    }
+
+    size_t read = 0;
+    unsigned long lastData = millis();
+    while(read < HTTP_UPDATE_IMAGE_HEADER_SIZE) {
+        int n = http.read(header + read, HTTP_UPDATE_IMAGE_HEADER_SIZE - read);
+        if(n > 0) {
+            read += n;
+            lastData = millis();
+        } else if(!http.connected() || millis() - lastData > (unsigned long)_httpClientTimeout) {
+            log_e("Reading image header failed\n");
+            return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+        } else {
+            delay(1);
+        }
+    }
+
+    const esp_image_header_t* image = (const esp_image_header_t*)header;
+    const esp_image_segment_header_t* segment = (const esp_image_segment_header_t*)(header + sizeof(esp_image_header_t));
+    const esp_app_desc_t* app = (const esp_app_desc_t*)(header + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t));
+
+    // check for valid first magic byte
+    if(image->magic != ESP_IMAGE_HEADER_MAGIC) {
+        log_e("Magic header does not start with 0xE9\n");
+        return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+    }
+
+    if(image->segment_count == 0 || image->segment_count > ESP_IMAGE_MAX_SEGMENTS) {
+        log_e("Invalid segment count (%d)\n", image->segment_count);
+        return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+    }
+
+    if(image->spi_mode > ESP_IMAGE_SPI_MODE_SLOW_READ || image->spi_size >= ESP_IMAGE_FLASH_SIZE_MAX) {
+        log_e("Invalid flash mode (%d) or size (%d)\n", image->spi_mode, image->spi_size);
+        return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+    }
+
+    // check if new bin fits to SPI flash
+    uint32_t bin_flash_size = (1024 * 1024) << image->spi_size;
+    if(bin_flash_size > ESP.getFlashChipSize()) {
+        log_e("New binary does not fit SPI Flash size\n");
+        return HTTP_UE_BIN_FOR_WRONG_FLASH;
+    }
+
+    esp_image_header_t running;
+    if(esp_partition_read(esp_ota_get_running_partition(), 0, &running, sizeof(running)) == ESP_OK) {
+        if(image->chip_id != running.chip_id) {
+            log_e("New binary is for chip %d, running on %d\n", image->chip_id, running.chip_id);
+            return HTTP_UE_BIN_FOR_WRONG_CHIP;
+        }
+    }
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+    uint16_t minChipRevision = image->min_chip_rev_full;
+#else
+    uint16_t minChipRevision = image->min_chip_rev;
+#endif
+    if(minChipRevision > ESP.getChipRevision()) {
+        log_e("New binary needs chip revision %d, running on %d\n", minChipRevision, ESP.getChipRevision());
+        return HTTP_UE_BIN_FOR_WRONG_CHIP;
+    }
+
+    if(segment->data_len < sizeof(esp_app_desc_t) || app->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        log_e("App description not found\n");
+        return HTTP_UE_BIN_VERIFY_HEADER_FAILED;
+    }
+
+    if(_checkProjectName) {
+#if ESP_IDF_VERSION_MAJOR >= 5
+        const esp_app_desc_t* runningApp = esp_app_get_description();
+#else
+        const esp_app_desc_t* runningApp = esp_ota_get_app_description();
+#endif
+        if(strncmp(app->project_name, runningApp->project_name, sizeof(app->project_name)) != 0) {
+            log_e("New binary is project \"%.32s\", running \"%.32s\"\n", app->project_name, runningApp->project_name);
+            return HTTP_UE_BIN_WRONG_PROJECT;
+        }
+    }
+
+    log_d("Image header ok: %d segments, project %.32s, version %.32s\n", image->segment_count, app->project_name, app->version);
+    return 0;
+}
+
+/**
+ *
+ * @param http HTTPClient *
+ * @param currentVersion const char *
+ * @param url const String& url http was begun with, empty if unknown
+ * @return HttpUpdateResult
+ */
+HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& currentVersion, bool spiffs, const String& url)
+{
+
+    HttpUpdateResult ret = HTTP_UPDATE_FAILED;
+
+    HttpClientEx::Headers headers[] = { String("x-MD5"), String("Location") };
+    int code = requestUpdate(http, url, currentVersion, spiffs, 0, headers, sizeof(headers)/sizeof(*headers));
+    if(code < 0) {
+        _setLastError(code);
+        return HTTP_UPDATE_FAILED;
+    }
 
-    HttpClientEx::Headers headers[] = { String("x-MD5") };
-    http.collectHeaders(headers, sizeof(headers)/sizeof(*headers));
     _md5 = headers[0].value;
     if (_md5 && !_md5.isEmpty())
     {
@@ -313,33 +676,14 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
     switch(code) {
     case HTTP_CODE_OK:  ///< OK (Start Update)
         if(len > 0) {
-            bool startUpdate = true;
-            if(spiffs) {
-                const esp_partition_t* _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
-                if(!_partition){
-                    _setLastError(HTTP_UE_NO_PARTITION);
-                    return HTTP_UPDATE_FAILED;
-                }
-
-                if(len > _partition->size) {
-                    log_e("spiffsSize to low (%d) needed: %d\n", _partition->size, len);
-                    startUpdate = false;
-                }
-            } else {
-                int sketchFreeSpace = ESP.getFreeSketchSpace();
-                if(!sketchFreeSpace){
-                    _setLastError(HTTP_UE_NO_PARTITION);
-                    return HTTP_UPDATE_FAILED;
-                }
-
-                if(len > sketchFreeSpace) {
-                    log_e("FreeSketchSpace to low (%d) needed: %d\n", sketchFreeSpace, len);
-                    startUpdate = false;
-                }
-            }
-
-            if(!startUpdate) {
-                _setLastError(HTTP_UE_TOO_LESS_SPACE);
+            alignas(4) uint8_t header[HTTP_UPDATE_IMAGE_HEADER_SIZE];
+            int headerError;
+            if(!checkUpdateSpace(len, spiffs)) {
+                ret = HTTP_UPDATE_FAILED;
+            } else if(!spiffs && (headerError = checkImageHeader(http, len, header)) != 0) {
+                _setLastError(headerError);
+                forgetRedirect(url);
+//                http.end();
                 ret = HTTP_UPDATE_FAILED;
             } else {
                 // Warn main app we're starting up...
@@ -354,49 +698,18 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
 
                 delay(100);
 
-                int command;
+                bool ok;
 
                 if(spiffs) {
-                    command = U_SPIFFS;
                     log_d("runUpdate spiffs...\n");
+                    ok = runUpdate(*tcp, len, _md5, U_SPIFFS);
                 } else {
-                    command = U_FLASH;
+                    // the image header was read already, so writeStream() can't be used
                     log_d("runUpdate flash...\n");
+                    ok = runImageUpdate(*tcp, len, _md5, header);
                 }
 
-                if(!spiffs) {
-/* To do
-                    uint8_t buf[4];
-                    if(tcp->peekBytes(&buf[0], 4) != 4) {
-                        log_e("peekBytes magic header failed\n");
-                        _setLastError(HTTP_UE_BIN_VERIFY_HEADER_FAILED);
-                        http.end();
-                        return HTTP_UPDATE_FAILED;
-                    }
-*/
-
-                    // check for valid first magic byte
-//                    if(buf[0] != 0xE9) {
-                    if(tcp->peek() != 0xE9) {
-                        log_e("Magic header does not start with 0xE9\n");
-                        _setLastError(HTTP_UE_BIN_VERIFY_HEADER_FAILED);
-//                        http.end();
-                        return HTTP_UPDATE_FAILED;
-
-                    }
-/* To do
-                    uint32_t bin_flash_size = ESP.magicFlashChipSize((buf[3] & 0xf0) >> 4);
-
-                    // check if new bin fits to SPI flash
-                    if(bin_flash_size > ESP.getFlashChipRealSize()) {
-                        log_e("New binary does not fit SPI Flash size\n");
-                        _setLastError(HTTP_UE_BIN_FOR_WRONG_FLASH);
-                        http.end();
-                        return HTTP_UPDATE_FAILED;
-                    }
-*/
-                }
-                if(runUpdate(*tcp, len, _md5, command)) {
+                if(ok) {
                     ret = HTTP_UPDATE_OK;
                     log_d("Update ok\n");
 //                    http.end();
@@ -411,6 +724,7 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
 
                 } else {
                     ret = HTTP_UPDATE_FAILED;
+                    forgetRedirect(url);
                     log_e("Update failed\n");
                 }
             }
@@ -443,6 +757,425 @@ HttpUpdateResult HttpUpdate::handleUpdate(HttpClientEx& http, const String& curr
     return ret;
 }
 
+/**
+ * update from the best scoring mirror, failing over to the next one
+ * @param client Client&
+ * @param urls const String[] in priority order
+ * @param count size_t
+ * @param currentVersion const String&
+ * @param spiffs bool
+ * @return HttpUpdateResult
+ */
+HttpUpdateResult HttpUpdate::handleMirrorUpdate(Client& client, const String urls[], size_t count,
+        const String& currentVersion, bool spiffs)
+{
+    if(count == 0) {
+        _setLastError(HTTP_UE_NO_MIRROR);
+        return HTTP_UPDATE_FAILED;
+    }
+    if(count > HTTP_UPDATE_MAX_MIRRORS) {
+        count = HTTP_UPDATE_MAX_MIRRORS;
+    }
+
+    loadMirrorScores();
+
+    // Mirrors never measured are probed first so they can be placed. Now and then
+    // one mirror is measured afresh, otherwise a mirror penalised for a single
+    // outage would stay at the end of the list for good.
+    if(count > 1) {
+        for(size_t i = 0; i < count; i++) {
+            if(!findMirrorScore(urls[i])) {
+                probeMirror(client, urls[i]);
+            }
+        }
+        if(random(HTTP_UPDATE_MIRROR_REPROBE) == 0) {
+            probeMirror(client, urls[random(count)], true);
+        }
+    }
+
+    // Order the mirrors by smoothed latency, keeping the given priority for ties.
+    size_t order[HTTP_UPDATE_MAX_MIRRORS];
+    uint16_t latency[HTTP_UPDATE_MAX_MIRRORS];
+    for(size_t i = 0; i < count; i++) {
+        MirrorScore* score = findMirrorScore(urls[i]);
+        latency[i] = score ? score->latency : UINT16_MAX;
+        size_t j = i;
+        while(j > 0 && latency[order[j - 1]] > latency[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int command = spiffs ? U_SPIFFS : U_FLASH;
+    HttpUpdateResult ret = HTTP_UPDATE_FAILED;
+    bool started = false;
+    bool fatal = false;
+    int mirrorError = 0;    // last per-mirror failure, reported once all mirrors were tried
+    uint32_t size = 0;
+    uint32_t written = 0;
+
+    for(size_t i = 0; i < count && !fatal && ret == HTTP_UPDATE_FAILED; i++) {
+        const String& url = urls[order[i]];
+        HttpClientEx http(client);
+
+        if(!http.begin(url)) {
+            mirrorError = HTTP_ERROR_API;
+            continue;
+        }
+
+        unsigned long start = millis();
+        HttpClientEx::Headers headers[] = { String("x-MD5"), String("Content-Range"), String("Location") };
+        int code = requestUpdate(http, url, currentVersion, spiffs, written, headers, sizeof(headers)/sizeof(*headers));
+        if(code < 0) {
+            log_e("Mirror %s failed: %d\n", url.c_str(), code);
+            recordMirrorLatency(url, _httpClientTimeout);
+            mirrorError = code;
+            http.stop();
+            continue;
+        }
+        recordMirrorLatency(url, millis() - start);
+
+        String md5 = headers[0].value;
+        md5.toLowerCase();
+        int len = http.contentLength();
+
+        log_d("Mirror %s: code %d, len %d, time to first byte %lu ms\n", url.c_str(), code, len, millis() - start);
+
+        uint32_t offset = 0;
+        if(!started) {
+            if(code == HTTP_CODE_NOT_MODIFIED) {
+                ret = HTTP_UPDATE_NO_UPDATES;
+                break;
+            }
+            if(code != HTTP_CODE_OK) {
+                mirrorError = code == HTTP_CODE_NOT_FOUND ? HTTP_UE_SERVER_FILE_NOT_FOUND :
+                              code == HTTP_CODE_FORBIDDEN ? HTTP_UE_SERVER_FORBIDDEN : HTTP_UE_SERVER_WRONG_HTTP_CODE;
+                log_e("Mirror %s: HTTP Code is (%d)\n", url.c_str(), code);
+                http.stop();
+                continue;
+            }
+            if(len <= 0) {
+                mirrorError = HTTP_UE_SERVER_NOT_REPORT_SIZE;
+                log_e("Mirror %s: Content-Length was 0 or wasn't set by Server?!\n", url.c_str());
+                http.stop();
+                continue;
+            }
+            if(!checkUpdateSpace(len, spiffs)) {
+                fatal = true;
+                break;
+            }
+            alignas(4) uint8_t header[HTTP_UPDATE_IMAGE_HEADER_SIZE];
+            int headerError = spiffs ? 0 : checkImageHeader(http, len, header);
+            if(headerError == HTTP_UE_BIN_VERIFY_HEADER_FAILED) {
+                // truncated or garbled, another mirror may serve it right
+                mirrorError = headerError;
+                forgetRedirect(url);
+                http.stop();
+                continue;
+            }
+            if(headerError) {
+                // an image for another flash, chip or project is the same on every mirror
+                _setLastError(headerError);
+                fatal = true;
+                break;
+            }
+
+            // Warn main app we're starting up...
+            if (_cbStart) {
+                _cbStart();
+            }
+
+            _md5 = md5;
+            if(!beginUpdate(len, _md5, command)) {
+                fatal = true;
+                break;
+            }
+            size = len;
+            started = true;
+
+            if(!spiffs) {
+                if(Update.write(header, HTTP_UPDATE_IMAGE_HEADER_SIZE) != HTTP_UPDATE_IMAGE_HEADER_SIZE) {
+                    _setLastError(Update.getError());
+                    fatal = true;
+                    break;
+                }
+                written = offset = HTTP_UPDATE_IMAGE_HEADER_SIZE;
+            }
+        } else {
+            // Resume: the mirror must serve the same image, from at most where we stopped
+            if(md5.length() && _md5.length() && md5 != _md5) {
+                log_e("Mirror %s serves a different image (MD5 %s)\n", url.c_str(), md5.c_str());
+                http.stop();
+                continue;
+            }
+            if(code == HTTP_CODE_PARTIAL_CONTENT) {
+                // Content-Range: bytes <first>-<last>/<size>
+                const String& range = headers[1].value;
+                offset = range.substring(range.indexOf(' ') + 1).toInt();
+                if(offset > written || len != (int)(size - offset) ||
+                   range.substring(range.indexOf('/') + 1).toInt() != (long)size) {
+                    log_e("Mirror %s: unexpected Content-Range \"%s\"\n", url.c_str(), range.c_str());
+                    http.stop();
+                    continue;
+                }
+            } else if(code != HTTP_CODE_OK || len != (int)size) {
+                log_e("Mirror %s cannot resume: HTTP Code is (%d), len %d\n", url.c_str(), code, len);
+                http.stop();
+                continue;
+            }
+            log_d("Mirror %s: resuming at %u from %u\n", url.c_str(), written, offset);
+        }
+
+        if(writeUpdateStream(http, size, offset, written)) {
+            if(endUpdate()) {
+                ret = HTTP_UPDATE_OK;
+            } else {
+                fatal = true;
+            }
+            break;
+        }
+
+        http.stop();
+        if(Update.hasError()) {
+            _setLastError(Update.getError());
+            fatal = true;
+        } else {
+            log_w("Mirror %s stalled at %u of %u bytes\n", url.c_str(), written, size);
+            recordMirrorLatency(url, _httpClientTimeout);
+            forgetRedirect(url);
+        }
+    }
+
+    saveMirrorScores();
+
+    if(ret == HTTP_UPDATE_OK) {
+        log_d("Update ok\n");
+        // Warn main app we're all done
+        if (_cbEnd) {
+            _cbEnd();
+        }
+
+        if(_rebootOnUpdate && !spiffs) {
+            ESP.restart();
+        }
+    } else if(ret == HTTP_UPDATE_FAILED) {
+        if(started) {
+            Update.abort();
+        }
+        if(!fatal) {
+            _setLastError(mirrorError ? mirrorError : HTTP_UE_ALL_MIRRORS_FAILED);
+        }
+        log_e("Update failed\n");
+    }
+
+    return ret;
+}
+
+/**
+ * measure the time to first byte of a mirror with a HEAD request
+ * @param client Client&
+ * @param url const String&
+ * @param reset bool replace the smoothed latency instead of adding a sample
+ */
+void HttpUpdate::probeMirror(Client& client, const String& url, bool reset)
+{
+    HttpClientEx http(client);
+    unsigned long start = millis();
+    int code = HTTP_ERROR_API;
+
+    if(http.begin(url)) {
+        http.setHttpResponseTimeout(_httpClientTimeout);
+        http.beginRequest();
+        code = http.startRequest(HTTP_METHOD_HEAD, NULL);
+        if(code == 0) {
+            http.sendAuthorizationHeader();
+            http.endRequest();
+            code = http.responseStatusCode();
+        }
+    }
+    http.stop();
+
+    log_d("Mirror %s probed: code %d, time to first byte %lu ms\n", url.c_str(), code, millis() - start);
+    recordMirrorLatency(url, code < 0 ? _httpClientTimeout : millis() - start, reset);
+}
+
+/**
+ * write the body of a response to the running Update
+ * @param in Client& positioned at the start of the body
+ * @param size uint32_t image size
+ * @param offset uint32_t image position of the first body byte
+ * @param written uint32_t& bytes already written, advanced as data arrives
+ * @return true if the whole image was written, false if the download stalled or Update failed
+ */
+bool HttpUpdate::writeUpdateStream(Client& in, uint32_t size, uint32_t offset, uint32_t& written)
+{
+    uint8_t buf[1024];
+    unsigned long lastData = millis();
+
+    while(written < size) {
+        int available = in.available();
+        if(available <= 0) {
+            if(!in.connected() || millis() - lastData > (unsigned long)_httpClientTimeout) {
+                return false;
+            }
+            delay(1);
+            continue;
+        }
+
+        size_t toRead = min((size_t)available, sizeof(buf));
+        toRead = min(toRead, (size_t)(size - offset));
+        int n = in.read(buf, toRead);
+        if(n <= 0) {
+            continue;
+        }
+        lastData = millis();
+
+        // skip what an earlier mirror already delivered
+        uint32_t skip = offset < written ? min((uint32_t)n, written - offset) : 0;
+        offset += n;
+        if(skip == (uint32_t)n) {
+            continue;
+        }
+
+        if(Update.write(buf + skip, n - skip) != n - skip) {
+            return false;
+        }
+        written += n - skip;
+
+        if (_cbProgress) {
+            _cbProgress(written, size);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * smoothed time-to-first-byte of a mirror
+ * @param url const String&
+ * @return int ms, or -1 if the mirror was never measured
+ */
+int HttpUpdate::getMirrorLatency(const String& url)
+{
+    loadMirrorScores();
+    MirrorScore* score = findMirrorScore(url);
+    return score ? score->latency : -1;
+}
+
+void HttpUpdate::clearMirrorScores(void)
+{
+    // load first, so the saved copy is known to differ and gets overwritten
+    loadMirrorScores();
+    memset(_mirrorScores, 0, sizeof(_mirrorScores));
+    _mirrorScoresDirty = true;
+    saveMirrorScores();
+}
+
+static uint32_t mirrorHash(const String& url)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < url.length(); i++) {
+        hash = (hash ^ (uint8_t)url[i]) * 16777619u;
+    }
+    return hash;
+}
+
+HttpUpdate::MirrorScore* HttpUpdate::findMirrorScore(const String& url)
+{
+    uint32_t hash = mirrorHash(url);
+    for(size_t i = 0; i < HTTP_UPDATE_MIRROR_SCORES; i++) {
+        if(_mirrorScores[i].samples && _mirrorScores[i].urlHash == hash) {
+            return &_mirrorScores[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * add a time-to-first-byte sample to the scoreboard, failures count as a full timeout
+ * @param url const String&
+ * @param latency uint32_t ms
+ * @param reset bool start the smoothing over from this sample
+ */
+void HttpUpdate::recordMirrorLatency(const String& url, uint32_t latency, bool reset)
+{
+    latency = min(latency, (uint32_t)UINT16_MAX);
+
+    MirrorScore* score = findMirrorScore(url);
+    if(score && reset) {
+        score->latency = latency;
+        score->samples = 1;
+    } else if(score) {
+        score->latency = (3 * score->latency + latency) / 4;
+        if(score->samples < UINT16_MAX) {
+            score->samples++;
+        }
+    } else {
+        // take a free slot, or replace the slowest mirror
+        score = &_mirrorScores[0];
+        for(size_t i = 0; i < HTTP_UPDATE_MIRROR_SCORES && score->samples; i++) {
+            if(!_mirrorScores[i].samples || _mirrorScores[i].latency > score->latency) {
+                score = &_mirrorScores[i];
+            }
+        }
+        score->urlHash = mirrorHash(url);
+        score->latency = latency;
+        score->samples = 1;
+    }
+    _mirrorScoresDirty = true;
+}
+
+void HttpUpdate::loadMirrorScores(void)
+{
+    if(_mirrorScoresLoaded) {
+        return;
+    }
+    _mirrorScoresLoaded = true;
+
+    if(!_persistMirrorScores) {
+        return;
+    }
+    Preferences prefs;
+    if(prefs.begin("HttpUpdate", true)) {
+        if(prefs.getBytesLength("mirrors") == sizeof(_mirrorScores)) {
+            prefs.getBytes("mirrors", _mirrorScores, sizeof(_mirrorScores));
+            memcpy(_savedMirrorScores, _mirrorScores, sizeof(_savedMirrorScores));
+        }
+        prefs.end();
+    }
+}
+
+void HttpUpdate::saveMirrorScores(void)
+{
+    if(!_mirrorScoresDirty || !_persistMirrorScores) {
+        return;
+    }
+    _mirrorScoresDirty = false;
+
+    // Spare the flash: rewrite only when a mirror came or went, or its
+    // latency moved by more than a quarter since the last write
+    bool changed = false;
+    for(size_t i = 0; i < HTTP_UPDATE_MIRROR_SCORES && !changed; i++) {
+        const MirrorScore& score = _mirrorScores[i];
+        const MirrorScore& saved = _savedMirrorScores[i];
+        int diff = abs((int)score.latency - (int)saved.latency);
+        changed = !score.samples != !saved.samples || score.urlHash != saved.urlHash ||
+                  (diff > HTTP_UPDATE_MIRROR_SCORE_SLACK && diff > saved.latency / 4);
+    }
+    if(!changed) {
+        return;
+    }
+    memcpy(_savedMirrorScores, _mirrorScores, sizeof(_savedMirrorScores));
+
+    Preferences prefs;
+    if(prefs.begin("HttpUpdate", false)) {
+        prefs.putBytes("mirrors", _mirrorScores, sizeof(_mirrorScores));
+        prefs.end();
+    }
+}
+
 /**
  * write Update to flash
  * @param in Stream&
@@ -459,6 +1192,80 @@ bool HttpUpdate::runUpdate(Stream& in, uint32_t size, String md5, int command)
         Update.onProgress(_cbProgress);
     }
 
+    if(!beginUpdate(size, md5, command)) {
+        return false;
+    }
+
+    if(Update.writeStream(in) != size) {
+        _setLastError(Update.getError());
+        Update.printError(error);
+        error.trim(); // remove line ending
+        log_e("Update.writeStream failed! (%s)\n", error.c_str());
+        return false;
+    }
+
+    if (_cbProgress) {
+        _cbProgress(size, size);
+    }
+
+    return endUpdate();
+}
+
+/**
+ * write an app image to flash whose header was already read from in
+ * @param in Client&
+ * @param size uint32_t
+ * @param md5 String
+ * @param header const uint8_t* first HTTP_UPDATE_IMAGE_HEADER_SIZE bytes of the image
+ * @return true if Update ok
+ */
+bool HttpUpdate::runImageUpdate(Client& in, uint32_t size, const String& md5, const uint8_t* header)
+{
+
+    StreamString error;
+
+    if(!beginUpdate(size, md5, U_FLASH)) {
+        return false;
+    }
+
+    if(Update.write((uint8_t*)header, HTTP_UPDATE_IMAGE_HEADER_SIZE) != HTTP_UPDATE_IMAGE_HEADER_SIZE) {
+        _setLastError(Update.getError());
+        Update.printError(error);
+        error.trim(); // remove line ending
+        log_e("Update.write failed! (%s)\n", error.c_str());
+        return false;
+    }
+
+    uint32_t written = HTTP_UPDATE_IMAGE_HEADER_SIZE;
+    if(!writeUpdateStream(in, size, written, written)) {
+        if(Update.hasError()) {
+            _setLastError(Update.getError());
+            Update.printError(error);
+            error.trim(); // remove line ending
+            log_e("Update.write failed! (%s)\n", error.c_str());
+        } else {
+            Update.abort();
+            _setLastError(HTTP_UE_DOWNLOAD_STALLED);
+            log_e("Download stalled at %u of %u bytes\n", written, size);
+        }
+        return false;
+    }
+
+    return endUpdate();
+}
+
+/**
+ * start an Update of size bytes
+ * @param size uint32_t
+ * @param md5 String
+ * @param command int
+ * @return true if Update started
+ */
+bool HttpUpdate::beginUpdate(uint32_t size, const String& md5, int command)
+{
+
+    StreamString error;
+
     if(!Update.begin(size, command, _ledPin, _ledOn)) {
         _setLastError(Update.getError());
         Update.printError(error);
@@ -475,23 +1282,24 @@ bool HttpUpdate::runUpdate(Stream& in, uint32_t size, String md5, int command)
         if(!Update.setMD5(md5.c_str())) {
             _setLastError(HTTP_UE_SERVER_FAULTY_MD5);
             log_e("Update.setMD5 failed! (%s)\n", md5.c_str());
+            Update.abort();
             return false;
         }
     }
 
 // To do: the SHA256 could be checked if the server sends it
 
-    if(Update.writeStream(in) != size) {
-        _setLastError(Update.getError());
-        Update.printError(error);
-        error.trim(); // remove line ending
-        log_e("Update.writeStream failed! (%s)\n", error.c_str());
-        return false;
-    }
+    return true;
+}
 
-    if (_cbProgress) {
-        _cbProgress(size, size);
-    }
+/**
+ * finish the running Update
+ * @return true if Update ok
+ */
+bool HttpUpdate::endUpdate(void)
+{
+
+    StreamString error;
 
     if(!Update.end()) {
         _setLastError(Update.getError());
@@ -28,6 +28,8 @@
 #include <Arduino.h>
 #include <HttpClientEx.h>
 #include <Update.h>
+#include <esp_app_format.h>
+#include "TlsSessionCache.h"
 
 /// note we use HTTP client errors too so we start at 100
 #define HTTP_UE_TOO_LESS_SPACE              (-100)
@@ -39,6 +41,45 @@
 #define HTTP_UE_BIN_VERIFY_HEADER_FAILED    (-106)
 #define HTTP_UE_BIN_FOR_WRONG_FLASH         (-107)
 #define HTTP_UE_NO_PARTITION                (-108)
+#define HTTP_UE_NO_MIRROR                   (-109)
+#define HTTP_UE_ALL_MIRRORS_FAILED          (-110)
+#define HTTP_UE_BIN_FOR_WRONG_CHIP          (-111)
+#define HTTP_UE_BIN_WRONG_PROJECT           (-112)
+#define HTTP_UE_TOO_MANY_REDIRECTS          (-113)
+#define HTTP_UE_DOWNLOAD_STALLED            (-114)
+
+/// number of resolved redirects remembered
+#ifndef HTTP_UPDATE_REDIRECTS
+#define HTTP_UPDATE_REDIRECTS               4
+#endif
+
+/// how long a temporary (302/303/307) redirect target is reused, in ms
+#ifndef HTTP_UPDATE_REDIRECT_TTL
+#define HTTP_UPDATE_REDIRECT_TTL            (10 * 60 * 1000UL)
+#endif
+
+/// image header block checked before the update starts: image header, first segment header and app description
+#define HTTP_UPDATE_IMAGE_HEADER_SIZE       (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+
+/// maximum number of mirrors considered by a single mirror update
+#ifndef HTTP_UPDATE_MAX_MIRRORS
+#define HTTP_UPDATE_MAX_MIRRORS             4
+#endif
+
+/// latency change in ms below which the scoreboard is not rewritten to NVS
+#ifndef HTTP_UPDATE_MIRROR_SCORE_SLACK
+#define HTTP_UPDATE_MIRROR_SCORE_SLACK      20
+#endif
+
+/// number of mirrors remembered in the latency scoreboard
+#ifndef HTTP_UPDATE_MIRROR_SCORES
+#define HTTP_UPDATE_MIRROR_SCORES           8
+#endif
+
+/// one in this many mirror updates re-measures a random mirror, so a penalised mirror can recover
+#ifndef HTTP_UPDATE_MIRROR_REPROBE
+#define HTTP_UPDATE_MIRROR_REPROBE          8
+#endif
 
 enum HttpUpdateResult {
     HTTP_UPDATE_FAILED,
@@ -65,14 +106,36 @@ public:
         _rebootOnUpdate = reboot;
     }
     
-    // /**
-    //   * set redirect follow mode. See `followRedirects_t` enum for avaliable modes.
-    //   * @param follow
-    //   */
-    // void setFollowRedirects(followRedirects_t follow)
-    // {
-    //     _followRedirects = follow;
-    // }
+    /**
+      * follow 301, 302, 303, 307 and 308 redirects (default false).
+      * Resolved targets are cached, permanent ones until they fail and
+      * temporary ones for HTTP_UPDATE_REDIRECT_TTL.
+      * @param follow
+      */
+    void setFollowRedirects(bool follow)
+    {
+        _followRedirects = follow;
+    }
+
+    /**
+      * maximum number of redirects followed for one request (default 10)
+      * @param limit
+      */
+    void setRedirectLimit(uint16_t limit)
+    {
+        _redirectLimit = limit;
+    }
+
+    void clearRedirectCache(void);
+
+    /**
+      * reject images whose project name differs from the running firmware (default true)
+      * @param check
+      */
+    void setCheckProjectName(bool check)
+    {
+        _checkProjectName = check;
+    }
 
     void setLedPin(int ledPin = -1, uint8_t ledOn = HIGH)
     {
@@ -87,11 +150,46 @@ public:
 
     t_httpUpdate_return updateSpiffs(Client& client, const String& url, const String& currentVersion = "");
 
+    /**
+      * update through an HttpClientEx the caller has already begun.
+      * The url it was begun with is not known here, so only redirects to an
+      * absolute Location are followed and no redirect is cached; a relative
+      * Location fails with HTTP_UE_SERVER_WRONG_HTTP_CODE.
+      */
     t_httpUpdate_return update(HttpClientEx& httpClient,
                                const String& currentVersion = "");
 
     t_httpUpdate_return updateSpiffs(HttpClientEx &httpClient, const String &currentVersion = "");
 
+    /**
+      * update from a list of mirrors serving the same image, given in priority order.
+      * Mirrors are tried by their measured time-to-first-byte, mirrors never measured are
+      * probed with a HEAD request first. When a mirror fails mid-download the next one
+      * is asked for the rest of the image with a Range request.
+      * @param client Client used for all the connections
+      * @param urls mirror urls, at most HTTP_UPDATE_MAX_MIRRORS are used
+      * @param count number of urls
+      */
+    t_httpUpdate_return update(Client& client, const String urls[], size_t count, const String& currentVersion = "");
+
+    t_httpUpdate_return updateSpiffs(Client& client, const String urls[], size_t count, const String& currentVersion = "");
+
+    /**
+      * keep the mirror latency scoreboard in NVS so it survives reboots (default true)
+      * @param persist
+      */
+    void setMirrorScorePersistence(bool persist)
+    {
+        _persistMirrorScores = persist;
+    }
+
+    /**
+      * smoothed time-to-first-byte of a mirror in ms, or -1 if it was never measured
+      * @param url
+      */
+    int getMirrorLatency(const String& url);
+    void clearMirrorScores(void);
+
     // Notification callbacks
     void onStart(HttpUpdateStartCB cbOnStart)          { _cbStart = cbOnStart; }
     void onEnd(HttpUpdateEndCB cbOnEnd)                { _cbEnd = cbOnEnd; }
@@ -101,9 +199,31 @@ public:
     int getLastError(void);
     String getLastErrorString(void);
 
+    /**
+      * TLS session cache for update checks. TlsClient uses the one of the global
+      * httpUpdate by default; other mbedTLS clients call restore(), handshake()
+      * and save() of TlsSessionCache around their handshake.
+      */
+    TlsSessionCache& tlsSessions(void)     { return _tlsSessions; }
+    uint32_t getTlsSessionHits(void) const   { return _tlsSessions.hits(); }
+    uint32_t getTlsSessionMisses(void) const { return _tlsSessions.misses(); }
+
 protected:
-    t_httpUpdate_return handleUpdate(HttpClientEx& http, const String& currentVersion, bool spiffs = false);
+    t_httpUpdate_return handleUpdate(HttpClientEx& http, const String& currentVersion, bool spiffs = false,
+                                     const String& url = "");
     bool runUpdate(Stream& in, uint32_t size, String md5, int command = U_FLASH);
+    bool runImageUpdate(Client& in, uint32_t size, const String& md5, const uint8_t* header);
+    t_httpUpdate_return handleMirrorUpdate(Client& client, const String urls[], size_t count,
+                                           const String& currentVersion, bool spiffs);
+    int sendUpdateRequest(HttpClientEx& http, const String& currentVersion, bool spiffs, uint32_t rangeStart = 0);
+    int requestUpdate(HttpClientEx& http, const String& url, const String& currentVersion, bool spiffs,
+                      uint32_t rangeStart, HttpClientEx::Headers* headers, size_t count);
+    bool checkUpdateSpace(int len, bool spiffs);
+    int checkImageHeader(HttpClientEx& http, int len, uint8_t* header);
+    bool beginUpdate(uint32_t size, const String& md5, int command);
+    bool endUpdate(void);
+    void probeMirror(Client& client, const String& url, bool reset = false);
+    bool writeUpdateStream(Client& in, uint32_t size, uint32_t offset, uint32_t& written);
 
     // Set the error and potentially use a CB to notify the application
     void _setLastError(int err) {
@@ -114,10 +234,12 @@ protected:
     }
     int _lastError;
     bool _rebootOnUpdate = true;
+    bool _checkProjectName = true;
     String _md5;
 private:
     int _httpClientTimeout;
-    // followRedirects_t _followRedirects;
+    bool _followRedirects = false;
+    uint16_t _redirectLimit = 10;
 
     // Callbacks
     HttpUpdateStartCB    _cbStart;
@@ -127,6 +249,38 @@ private:
 
     int _ledPin;
     uint8_t _ledOn;
+
+    TlsSessionCache _tlsSessions;
+
+    // Resolved redirect cache
+    struct RedirectEntry {
+        String url;         // empty marks a free slot
+        String target;
+        bool permanent;
+        unsigned long seen;
+    };
+    RedirectEntry _redirects[HTTP_UPDATE_REDIRECTS];
+
+    RedirectEntry* findRedirect(const String& url);
+    void rememberRedirect(const String& url, const String& target, bool permanent);
+    void forgetRedirect(const String& url);
+
+    // Mirror latency scoreboard
+    struct MirrorScore {
+        uint32_t urlHash;
+        uint16_t latency;   // smoothed time-to-first-byte in ms
+        uint16_t samples;   // 0 marks a free slot
+    };
+    MirrorScore _mirrorScores[HTTP_UPDATE_MIRROR_SCORES] = {};
+    MirrorScore _savedMirrorScores[HTTP_UPDATE_MIRROR_SCORES] = {};    // as last written to NVS
+    bool _mirrorScoresLoaded = false;
+    bool _mirrorScoresDirty = false;
+    bool _persistMirrorScores = true;
+
+    MirrorScore* findMirrorScore(const String& url);
+    void recordMirrorLatency(const String& url, uint32_t latency, bool reset = false);
+    void loadMirrorScores(void);
+    void saveMirrorScores(void);
 };
 
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_HTTPUPDATE)
@@ -0,0 +1,303 @@
+/*
+ * TLS client for HttpUpdate
+ *
+ * This file is part of the ESP32 Http Updater and is licensed under the
+ * GNU Lesser General Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "TlsClient.h"
+#include "HttpUpdate.h"
+
+TlsClient::TlsClient(Client& transport)
+        : _transport(transport), _sessions(NULL)
+{
+#if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_HTTPUPDATE) && !defined(NO_GLOBAL_HttpUpdate)
+    _sessions = &httpUpdate.tlsSessions();
+#endif
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_x509_crt_init(&_ca);
+}
+
+TlsClient::TlsClient(Client& transport, TlsSessionCache* sessions)
+        : _transport(transport), _sessions(sessions)
+{
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_x509_crt_init(&_ca);
+}
+
+TlsClient::~TlsClient(void)
+{
+    stop();
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+    stop();
+    if(!_transport.connect(ip, port)) {
+        return 0;
+    }
+    String host = ip.toString();
+    int ret = startTls(host.c_str(), port);
+    if(ret != 0) {
+        log_e("TLS handshake with %s:%u failed (-0x%04x)\n", host.c_str(), port, (unsigned)-ret);
+        stop();
+        return 0;
+    }
+    _connected = true;
+    return 1;
+}
+
+int TlsClient::connect(const char* host, uint16_t port)
+{
+    stop();
+    if(!_transport.connect(host, port)) {
+        return 0;
+    }
+    int ret = startTls(host, port);
+    if(ret != 0) {
+        log_e("TLS handshake with %s:%u failed (-0x%04x)\n", host, port, (unsigned)-ret);
+        stop();
+        return 0;
+    }
+    _connected = true;
+    return 1;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+    _handshakeTimeout = timeout;
+    return connect(ip, port);
+}
+
+int TlsClient::connect(const char* host, uint16_t port, int32_t timeout)
+{
+    _handshakeTimeout = timeout;
+    return connect(host, port);
+}
+
+/**
+ * set up mbedTLS on the connected transport and run the handshake,
+ * resuming the cached session of host:port if there is one
+ * @return 0 or mbedTLS error
+ */
+int TlsClient::startTls(const char* host, uint16_t port)
+{
+    int ret;
+
+    if(!_seeded) {
+        ret = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, (const unsigned char*)"HttpUpdate", 10);
+        if(ret != 0) {
+            return ret;
+        }
+        _seeded = true;
+    }
+
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_ssl_config_init(&_conf);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_x509_crt_init(&_ca);
+
+    ret = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if(ret != 0) {
+        return ret;
+    }
+    if(_rootCA) {
+        ret = mbedtls_x509_crt_parse(&_ca, (const unsigned char*)_rootCA, strlen(_rootCA) + 1);
+        if(ret != 0) {
+            return ret;
+        }
+        mbedtls_ssl_conf_ca_chain(&_conf, &_ca, NULL);
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else if(_insecure) {
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+    } else {
+        log_e("No root certificate, call setCACert() or setInsecure()\n");
+        return MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+    }
+    mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+
+    ret = mbedtls_ssl_setup(&_ssl, &_conf);
+    if(ret != 0) {
+        return ret;
+    }
+    ret = mbedtls_ssl_set_hostname(&_ssl, host);
+    if(ret != 0) {
+        return ret;
+    }
+    mbedtls_ssl_set_bio(&_ssl, &_transport, send, recv, NULL);
+
+    if(_sessions) {
+        _sessions->restore(host, port, &_ssl);
+    }
+
+    unsigned long start = millis();
+    while((ret = _sessions ? _sessions->handshake(&_ssl) : mbedtls_ssl_handshake(&_ssl)) != 0) {
+        if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            break;
+        }
+        if(millis() - start > _handshakeTimeout) {
+            ret = MBEDTLS_ERR_SSL_TIMEOUT;
+            break;
+        }
+        delay(1);
+    }
+
+    if(_sessions) {
+        if(ret == 0) {
+            _sessions->save(host, port, &_ssl);
+        } else {
+            // don't offer a session the server may have choked on again
+            _sessions->forget(host, port);
+        }
+    }
+    return ret;
+}
+
+int TlsClient::send(void* ctx, const unsigned char* buf, size_t len)
+{
+    Client* transport = (Client*)ctx;
+    if(!transport->connected()) {
+        return MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    size_t n = transport->write(buf, len);
+    return n > 0 ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::recv(void* ctx, unsigned char* buf, size_t len)
+{
+    Client* transport = (Client*)ctx;
+    if(transport->available() <= 0) {
+        return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    int n = transport->read(buf, len);
+    return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+size_t TlsClient::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t TlsClient::write(const uint8_t* buf, size_t size)
+{
+    if(!_connected) {
+        return 0;
+    }
+
+    size_t written = 0;
+    unsigned long start = millis();
+    while(written < size) {
+        int ret = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+        if(ret > 0) {
+            written += ret;
+            start = millis();
+        } else if((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+                  millis() - start > _handshakeTimeout) {
+            log_e("TLS write failed (-0x%04x)\n", (unsigned)-ret);
+            _connected = false;
+            break;
+        } else {
+            delay(1);
+        }
+    }
+    return written;
+}
+
+int TlsClient::available(void)
+{
+    if(!_connected) {
+        return _peeked >= 0 ? 1 : 0;
+    }
+
+    // let mbedTLS decrypt whatever record has arrived
+    int ret = mbedtls_ssl_read(&_ssl, NULL, 0);
+    if(ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        _connected = false;
+    }
+    return mbedtls_ssl_get_bytes_avail(&_ssl) + (_peeked >= 0 ? 1 : 0);
+}
+
+int TlsClient::read(void)
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t* buf, size_t size)
+{
+    if(size == 0) {
+        return 0;
+    }
+
+    int n = 0;
+    if(_peeked >= 0) {
+        buf[n++] = _peeked;
+        _peeked = -1;
+        if(size == 1) {
+            return n;
+        }
+    }
+    if(!_connected) {
+        return n > 0 ? n : -1;
+    }
+
+    int ret = mbedtls_ssl_read(&_ssl, buf + n, size - n);
+    if(ret > 0) {
+        return n + ret;
+    }
+    if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        // close notify or error
+        _connected = false;
+    }
+    return n > 0 ? n : -1;
+}
+
+int TlsClient::peek(void)
+{
+    if(_peeked < 0) {
+        _peeked = read();
+    }
+    return _peeked;
+}
+
+void TlsClient::flush(void)
+{
+}
+
+void TlsClient::stop(void)
+{
+    if(_connected) {
+        mbedtls_ssl_close_notify(&_ssl);
+        _connected = false;
+    }
+    _peeked = -1;
+    _transport.stop();
+
+    // release the record buffers until the next connect
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_init(&_ssl);
+}
+
+uint8_t TlsClient::connected(void)
+{
+    if(!_connected) {
+        return _peeked >= 0 ? 1 : 0;
+    }
+    return _transport.connected() || available() > 0;
+}
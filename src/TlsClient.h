@@ -0,0 +1,100 @@
+/*
+ * TLS client for HttpUpdate
+ *
+ * This file is part of the ESP32 Http Updater and is licensed under the
+ * GNU Lesser General Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any later version.
+ *
+ * Runs mbedTLS over any Client, e.g. WiFiClient or EthernetClient, and
+ * resumes sessions through a TlsSessionCache. By default it uses the cache
+ * of the global httpUpdate, so repeated update checks against the same host
+ * get an abbreviated handshake.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef ___TLS_CLIENT_H___
+#define ___TLS_CLIENT_H___
+
+#include <Arduino.h>
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include "TlsSessionCache.h"
+
+class TlsClient : public Client
+{
+public:
+    TlsClient(Client& transport);
+    TlsClient(Client& transport, TlsSessionCache* sessions);
+    ~TlsClient(void);
+
+    /**
+      * verify the server against this root certificate (PEM), the string must outlive the client
+      * @param rootCA
+      */
+    void setCACert(const char* rootCA)
+    {
+        _rootCA = rootCA;
+    }
+
+    /**
+      * skip server verification
+      */
+    void setInsecure(void)
+    {
+        _insecure = true;
+    }
+
+    void setHandshakeTimeout(unsigned long timeout)
+    {
+        _handshakeTimeout = timeout;
+    }
+
+    void setSessionCache(TlsSessionCache* sessions)
+    {
+        _sessions = sessions;
+    }
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    int connect(IPAddress ip, uint16_t port, int32_t timeout);
+    int connect(const char* host, uint16_t port, int32_t timeout);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t* buf, size_t size);
+    int available(void);
+    int read(void);
+    int read(uint8_t* buf, size_t size);
+    int peek(void);
+    void flush(void);
+    void stop(void);
+    uint8_t connected(void);
+    operator bool() { return connected(); }
+
+private:
+    int startTls(const char* host, uint16_t port);
+    static int send(void* ctx, const unsigned char* buf, size_t len);
+    static int recv(void* ctx, unsigned char* buf, size_t len);
+
+    Client& _transport;
+    TlsSessionCache* _sessions;
+    const char* _rootCA = NULL;
+    bool _insecure = false;
+    unsigned long _handshakeTimeout = 10000;
+    bool _connected = false;
+    bool _seeded = false;
+    int _peeked = -1;
+
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _conf;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_entropy_context _entropy;
+    mbedtls_x509_crt _ca;
+};
+
+#endif /* ___TLS_CLIENT_H___ */
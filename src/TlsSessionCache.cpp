@@ -0,0 +1,203 @@
+/*
+ * TLS session cache for HttpUpdate
+ *
+ * This file is part of the ESP32 Http Updater and is licensed under the
+ * GNU Lesser General Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "TlsSessionCache.h"
+#include <mbedtls/version.h>
+
+#ifdef HTTP_UPDATE_TLS_SESSIONS_RTC
+#include <esp_attr.h>
+#endif
+
+// mbedTLS 3 hides the session fields
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+typedef struct {
+    uint32_t key;       // 0 marks a free slot
+    uint32_t used;
+    size_t len;
+    unsigned char data[HTTP_UPDATE_TLS_SESSION_SIZE];
+} tls_session_t;
+
+typedef struct {
+    uint32_t clock;
+    tls_session_t sessions[HTTP_UPDATE_TLS_SESSIONS];
+} tls_sessions_t;
+
+// Shared by all caches: a session belongs to the host, not to the updater
+#ifdef HTTP_UPDATE_TLS_SESSIONS_RTC
+RTC_DATA_ATTR
+#endif
+static tls_sessions_t _sessions;
+
+static uint32_t sessionKey(const char* host, uint16_t port)
+{
+    // FNV-1a over host and port
+    uint32_t hash = 2166136261u;
+    for(; *host; host++) {
+        hash = (hash ^ (uint8_t)*host) * 16777619u;
+    }
+    hash = (hash ^ (port & 0xff)) * 16777619u;
+    hash = (hash ^ (port >> 8)) * 16777619u;
+    return hash ? hash : 1;
+}
+
+static tls_session_t* findSession(uint32_t key)
+{
+    for(size_t i = 0; i < HTTP_UPDATE_TLS_SESSIONS; i++) {
+        if(_sessions.sessions[i].key == key) {
+            return &_sessions.sessions[i];
+        }
+    }
+    return NULL;
+}
+
+bool TlsSessionCache::restore(const char* host, uint16_t port, mbedtls_ssl_context* ssl)
+{
+    _offered = false;
+    _sentIdLen = 0;
+    _offeredKey = sessionKey(host, port);
+
+    tls_session_t* entry = findSession(_offeredKey);
+    if(!entry) {
+        return false;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    _offered = mbedtls_ssl_session_load(&session, entry->data, entry->len) == 0 &&
+               mbedtls_ssl_set_session(ssl, &session) == 0;
+    if(_offered) {
+        entry->used = ++_sessions.clock;
+    } else {
+        log_w("Cached TLS session for %s:%u is unusable\n", host, port);
+        entry->key = 0;
+    }
+    mbedtls_ssl_session_free(&session);
+
+    return _offered;
+}
+
+int TlsSessionCache::handshake(mbedtls_ssl_context* ssl)
+{
+    int ret = 0;
+    while(ssl->MBEDTLS_PRIVATE(state) != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        ret = mbedtls_ssl_handshake_step(ssl);
+
+        // The ClientHello is out and the ServerHello not parsed yet: this is
+        // the id the server will echo if it resumes the offered session.
+        if(_offered && !_sentIdLen && ssl->MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_SERVER_HELLO) {
+            const mbedtls_ssl_session* session = ssl->MBEDTLS_PRIVATE(session_negotiate);
+            _sentIdLen = min((size_t)session->MBEDTLS_PRIVATE(id_len), sizeof(_sentId));
+            memcpy(_sentId, session->MBEDTLS_PRIVATE(id), _sentIdLen);
+        }
+
+        if(ret != 0) {
+            break;
+        }
+    }
+    return ret;
+}
+
+void TlsSessionCache::save(const char* host, uint16_t port, mbedtls_ssl_context* ssl)
+{
+    uint32_t key = sessionKey(host, port);
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03020000
+    // TLS 1.3 echoes any legacy session id and resumes with tickets that arrive
+    // after the handshake, so such a session is neither counted nor cached
+    if(mbedtls_ssl_get_version_number(ssl) == MBEDTLS_SSL_VERSION_TLS1_3) {
+        _offered = false;
+        _sentIdLen = 0;
+        return;
+    }
+#endif
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if(mbedtls_ssl_get_session(ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        _misses++;
+        return;
+    }
+
+    if(key == _offeredKey && _offered && _sentIdLen != 0 &&
+       session.MBEDTLS_PRIVATE(id_len) == _sentIdLen &&
+       memcmp(session.MBEDTLS_PRIVATE(id), _sentId, _sentIdLen) == 0) {
+        _hits++;
+    } else {
+        _misses++;
+    }
+    _offered = false;
+    _sentIdLen = 0;
+
+    // size the session first, so one that does not fit never evicts another host
+    size_t len = 0;
+    int ret = mbedtls_ssl_session_save(&session, NULL, 0, &len);
+    if(ret != 0 && ret != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+        log_w("Saving TLS session for %s:%u failed (-0x%04x)\n", host, port, (unsigned)-ret);
+        forget(host, port);
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+    if(len > HTTP_UPDATE_TLS_SESSION_SIZE) {
+        log_w("TLS session for %s:%u needs %u bytes, HTTP_UPDATE_TLS_SESSION_SIZE is %u\n",
+              host, port, (unsigned)len, (unsigned)HTTP_UPDATE_TLS_SESSION_SIZE);
+        forget(host, port);
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+
+    // take the host's slot, a free one, or the least recently used
+    tls_session_t* entry = findSession(key);
+    for(size_t i = 0; !entry && i < HTTP_UPDATE_TLS_SESSIONS; i++) {
+        if(!_sessions.sessions[i].key) {
+            entry = &_sessions.sessions[i];
+        }
+    }
+    if(!entry) {
+        entry = &_sessions.sessions[0];
+        for(size_t i = 1; i < HTTP_UPDATE_TLS_SESSIONS; i++) {
+            if(_sessions.sessions[i].used < entry->used) {
+                entry = &_sessions.sessions[i];
+            }
+        }
+    }
+
+    ret = mbedtls_ssl_session_save(&session, entry->data, sizeof(entry->data), &len);
+    if(ret == 0) {
+        entry->key = key;
+        entry->len = len;
+        entry->used = ++_sessions.clock;
+    } else {
+        log_w("Saving TLS session for %s:%u failed (-0x%04x)\n", host, port, (unsigned)-ret);
+        entry->key = 0;
+    }
+    mbedtls_ssl_session_free(&session);
+}
+
+void TlsSessionCache::forget(const char* host, uint16_t port)
+{
+    tls_session_t* entry = findSession(sessionKey(host, port));
+    if(entry) {
+        entry->key = 0;
+    }
+}
+
+void TlsSessionCache::clear(void)
+{
+    for(size_t i = 0; i < HTTP_UPDATE_TLS_SESSIONS; i++) {
+        _sessions.sessions[i].key = 0;
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * TLS session cache for HttpUpdate
+ *
+ * This file is part of the ESP32 Http Updater and is licensed under the
+ * GNU Lesser General Public License as published by the Free Software Foundation;
+ * either version 2.1 of the License, or (at your option) any later version.
+ *
+ * Keeps mbedTLS sessions per host and port so that repeated update checks
+ * against the same server use an abbreviated handshake. The TLS client calls
+ * restore() after mbedtls_ssl_setup(), handshake() instead of
+ * mbedtls_ssl_handshake(), and save() once the handshake is done.
+ * TlsClient does this for any transport Client.
+ *
+ * Sessions are kept in RAM. Define HTTP_UPDATE_TLS_SESSIONS_RTC to keep them
+ * in RTC memory so they survive deep sleep; mind that the default two slots
+ * take about 4 KB of it.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef ___TLS_SESSION_CACHE_H___
+#define ___TLS_SESSION_CACHE_H___
+
+#include <Arduino.h>
+#include <mbedtls/ssl.h>
+
+/// number of hosts remembered
+#ifndef HTTP_UPDATE_TLS_SESSIONS
+#define HTTP_UPDATE_TLS_SESSIONS            2
+#endif
+
+/// room for one serialized session. ESP-IDF keeps the peer certificate
+/// (CONFIG_MBEDTLS_SSL_KEEP_PEER_CERTIFICATE) and a session then carries the
+/// server's whole leaf certificate; without it a few hundred bytes are enough.
+#ifndef HTTP_UPDATE_TLS_SESSION_SIZE
+#define HTTP_UPDATE_TLS_SESSION_SIZE        2048
+#endif
+
+/**
+  * The sessions themselves live in one store shared by every TlsSessionCache,
+  * since a session belongs to the host and not to the updater that fetched it.
+  * Only the hit and miss counters are per instance, so forget() and clear()
+  * affect all instances.
+  */
+class TlsSessionCache
+{
+public:
+    /**
+      * offer the cached session for host:port to the coming handshake
+      * @param host
+      * @param port
+      * @param ssl context after mbedtls_ssl_setup()
+      * @return true if a session was offered
+      */
+    bool restore(const char* host, uint16_t port, mbedtls_ssl_context* ssl);
+
+    /**
+      * run the handshake like mbedtls_ssl_handshake(), noting the session id
+      * the ClientHello actually carried so save() can tell a resumed session
+      * @param ssl
+      * @return 0, MBEDTLS_ERR_SSL_WANT_READ/WRITE or an mbedTLS error
+      */
+    int handshake(mbedtls_ssl_context* ssl);
+
+    /**
+      * count the finished handshake as a hit or a miss and cache its session.
+      * TLS 1.3 handshakes are neither counted nor cached.
+      * @param host
+      * @param port
+      * @param ssl context after a successful handshake
+      */
+    void save(const char* host, uint16_t port, mbedtls_ssl_context* ssl);
+
+    /**
+      * drop the session of host:port, e.g. when a handshake with it failed
+      */
+    void forget(const char* host, uint16_t port);
+
+    /**
+      * drop all sessions of all instances; the counters are kept
+      */
+    void clear(void);
+
+    uint32_t hits(void) const   { return _hits; }
+    uint32_t misses(void) const { return _misses; }
+
+private:
+    uint32_t _hits = 0;
+    uint32_t _misses = 0;
+
+    // Session id sent in the ClientHello after a restore. It is the cached id,
+    // or a fresh random one when a ticket is offered; the server echoes it
+    // when it resumes either way.
+    uint32_t _offeredKey = 0;
+    bool _offered = false;
+    size_t _sentIdLen = 0;
+    unsigned char _sentId[32];
+};
+
+#endif /* ___TLS_SESSION_CACHE_H___ */
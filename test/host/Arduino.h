@@ -0,0 +1,20 @@
+/*
+ * Minimal Arduino.h for building library sources on the host
+ */
+
+#ifndef ___HOST_ARDUINO_H___
+#define ___HOST_ARDUINO_H___
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define log_e(format, ...) fprintf(stderr, "[E] " format, ##__VA_ARGS__)
+#define log_w(format, ...) fprintf(stderr, "[W] " format, ##__VA_ARGS__)
+#define log_d(format, ...)
+
+#endif /* ___HOST_ARDUINO_H___ */
@@ -0,0 +1,273 @@
+/*
+ * Host test for TlsSessionCache
+ *
+ * Runs a local mbedTLS server on a socket pair and checks that a second
+ * connection through the cache resumes the session, by session id and by
+ * session ticket, that hits and misses are counted right, and that the
+ * resumed handshake is faster than the full one.
+ */
+
+#include "TlsSessionCache.h"
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/version.h>
+#if defined(MBEDTLS_PSA_CRYPTO_C)
+#include <psa/crypto.h>
+#endif
+
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+static int fdSend(void* ctx, const unsigned char* buf, size_t len)
+{
+    ssize_t n = ::send(*(int*)ctx, buf, len, MSG_NOSIGNAL);
+    return n > 0 ? (int)n : MBEDTLS_ERR_SSL_CONN_EOF;
+}
+
+static int fdRecv(void* ctx, unsigned char* buf, size_t len)
+{
+    ssize_t n = ::recv(*(int*)ctx, buf, len, 0);
+    return n > 0 ? (int)n : MBEDTLS_ERR_SSL_CONN_EOF;
+}
+
+static void limitToTls12(mbedtls_ssl_config* conf)
+{
+#if MBEDTLS_VERSION_MAJOR >= 3
+    mbedtls_ssl_conf_max_tls_version(conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#else
+    (void)conf;
+#endif
+}
+
+// A TLS server with a self-signed EC certificate, resuming by session id or by ticket
+class Server
+{
+public:
+    Server(bool tickets)
+    {
+        mbedtls_entropy_init(&_entropy);
+        mbedtls_ctr_drbg_init(&_drbg);
+        mbedtls_pk_init(&_key);
+        mbedtls_x509_crt_init(&_cert);
+        mbedtls_ssl_config_init(&_conf);
+        mbedtls_ssl_cache_init(&_cache);
+        mbedtls_ssl_ticket_init(&_ticket);
+
+        CHECK(mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, (const unsigned char*)"server", 6) == 0);
+        makeCertificate();
+
+        CHECK(mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) == 0);
+        mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+        CHECK(mbedtls_ssl_conf_own_cert(&_conf, &_cert, &_key) == 0);
+        limitToTls12(&_conf);
+        if(tickets) {
+            CHECK(mbedtls_ssl_ticket_setup(&_ticket, mbedtls_ctr_drbg_random, &_drbg, MBEDTLS_CIPHER_AES_256_GCM, 86400) == 0);
+            mbedtls_ssl_conf_session_tickets_cb(&_conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &_ticket);
+        } else {
+            mbedtls_ssl_conf_session_cache(&_conf, &_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+        }
+    }
+
+    ~Server()
+    {
+        mbedtls_ssl_ticket_free(&_ticket);
+        mbedtls_ssl_cache_free(&_cache);
+        mbedtls_ssl_config_free(&_conf);
+        mbedtls_x509_crt_free(&_cert);
+        mbedtls_pk_free(&_key);
+        mbedtls_ctr_drbg_free(&_drbg);
+        mbedtls_entropy_free(&_entropy);
+    }
+
+    void serve(int fd)
+    {
+        mbedtls_ssl_context ssl;
+        mbedtls_ssl_init(&ssl);
+        CHECK(mbedtls_ssl_setup(&ssl, &_conf) == 0);
+        mbedtls_ssl_set_bio(&ssl, &fd, fdSend, fdRecv, NULL);
+
+        int ret;
+        while((ret = mbedtls_ssl_handshake(&ssl)) == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        }
+        CHECK(ret == 0);
+
+        mbedtls_ssl_close_notify(&ssl);
+        mbedtls_ssl_free(&ssl);
+        close(fd);
+    }
+
+private:
+    void makeCertificate()
+    {
+        CHECK(mbedtls_pk_setup(&_key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)) == 0);
+        CHECK(mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(_key), mbedtls_ctr_drbg_random, &_drbg) == 0);
+
+        mbedtls_x509write_cert crt;
+        mbedtls_mpi serial;
+        mbedtls_x509write_crt_init(&crt);
+        mbedtls_mpi_init(&serial);
+
+        mbedtls_x509write_crt_set_subject_key(&crt, &_key);
+        mbedtls_x509write_crt_set_issuer_key(&crt, &_key);
+        CHECK(mbedtls_x509write_crt_set_subject_name(&crt, "CN=localhost") == 0);
+        CHECK(mbedtls_x509write_crt_set_issuer_name(&crt, "CN=localhost") == 0);
+        CHECK(mbedtls_mpi_lset(&serial, 1) == 0);
+        CHECK(mbedtls_x509write_crt_set_serial(&crt, &serial) == 0);
+        CHECK(mbedtls_x509write_crt_set_validity(&crt, "20200101000000", "20491231235959") == 0);
+        mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+
+        unsigned char der[1024];
+        int len = mbedtls_x509write_crt_der(&crt, der, sizeof(der), mbedtls_ctr_drbg_random, &_drbg);
+        CHECK(len > 0);
+        if(len > 0) {
+            // the DER is written at the end of the buffer
+            CHECK(mbedtls_x509_crt_parse_der(&_cert, der + sizeof(der) - len, len) == 0);
+        }
+
+        mbedtls_mpi_free(&serial);
+        mbedtls_x509write_crt_free(&crt);
+    }
+
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_pk_context _key;
+    mbedtls_x509_crt _cert;
+    mbedtls_ssl_config _conf;
+    mbedtls_ssl_cache_context _cache;
+    mbedtls_ssl_ticket_context _ticket;
+};
+
+class TestClient
+{
+public:
+    TestClient()
+    {
+        mbedtls_entropy_init(&_entropy);
+        mbedtls_ctr_drbg_init(&_drbg);
+        mbedtls_ssl_config_init(&_conf);
+
+        CHECK(mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, (const unsigned char*)"client", 6) == 0);
+        CHECK(mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) == 0);
+        mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+        mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+        limitToTls12(&_conf);
+    }
+
+    ~TestClient()
+    {
+        mbedtls_ssl_config_free(&_conf);
+        mbedtls_ctr_drbg_free(&_drbg);
+        mbedtls_entropy_free(&_entropy);
+    }
+
+    // connect through the cache like TlsClient does, return the handshake time in ms
+    double connect(Server& server, TlsSessionCache& cache)
+    {
+        int fds[2];
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        std::thread serverThread([&server, &fds]() { server.serve(fds[1]); });
+
+        mbedtls_ssl_context ssl;
+        mbedtls_ssl_init(&ssl);
+        CHECK(mbedtls_ssl_setup(&ssl, &_conf) == 0);
+        CHECK(mbedtls_ssl_set_hostname(&ssl, "localhost") == 0);
+        mbedtls_ssl_set_bio(&ssl, &fds[0], fdSend, fdRecv, NULL);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cache.restore("localhost", 443, &ssl);
+        int ret;
+        while((ret = cache.handshake(&ssl)) == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        CHECK(ret == 0);
+        if(ret == 0) {
+            cache.save("localhost", 443, &ssl);
+        }
+
+        mbedtls_ssl_close_notify(&ssl);
+        serverThread.join();
+        close(fds[0]);
+        mbedtls_ssl_free(&ssl);
+        return ms;
+    }
+
+private:
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_ssl_config _conf;
+};
+
+static void testResumption(bool tickets)
+{
+    const char* mode = tickets ? "session ticket" : "session id";
+    Server server(tickets);
+    TestClient client;
+    TlsSessionCache cache;
+    cache.clear();
+
+    double full = client.connect(server, cache);
+    CHECK(cache.hits() == 0);
+    CHECK(cache.misses() == 1);
+
+    double resumed = client.connect(server, cache);
+    CHECK(cache.hits() == 1);
+    CHECK(cache.misses() == 1);
+    CHECK(resumed < full);
+
+    printf("%s: full handshake %.2f ms, resumed %.2f ms\n", mode, full, resumed);
+}
+
+static void testServerForgotSession(void)
+{
+    Server first(false);
+    Server second(false);
+    TestClient client;
+    TlsSessionCache cache;
+    cache.clear();
+
+    client.connect(first, cache);
+    // the session is offered but the other server does not know it
+    client.connect(second, cache);
+    CHECK(cache.hits() == 0);
+    CHECK(cache.misses() == 2);
+
+    // the new session is cached in its place
+    client.connect(second, cache);
+    CHECK(cache.hits() == 1);
+}
+
+int main(void)
+{
+#if defined(MBEDTLS_PSA_CRYPTO_C)
+    CHECK(psa_crypto_init() == PSA_SUCCESS);
+#endif
+
+    testResumption(false);
+    testResumption(true);
+    testServerForgotSession();
+
+    if(failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}